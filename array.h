@@ -128,4 +128,80 @@ struct Array {
 
 };
 
+// Fixed capacity array that stores its elements inline, so it can live on the stack.
+// Nothing is heap allocated and elements are only constructed when pushed.
+// e.g.:
+// Fixed_Array<Move, 256> moves;
+// generate_moves(moves);
+template< typename T, int N >
+struct Fixed_Array {
+    alignas(T) unsigned char elements[N * sizeof(T)];
+    int m_size = 0;
+
+    Fixed_Array() {}
+
+    Fixed_Array(const Fixed_Array &other) {
+        for (int i = 0; i < other.m_size; ++i) push(other[i]);
+    }
+
+    Fixed_Array &operator=(const Fixed_Array &other) {
+        if (this != &other) {
+            clear();
+            for (int i = 0; i < other.m_size; ++i) push(other[i]);
+        }
+        return *this;
+    }
+
+    ~Fixed_Array() {
+        clear();
+    }
+
+    int size() const { return m_size; }
+    int capacity() const { return N; }
+
+    T *data() { return m_size == 0 ? nullptr : get_element_ptr(0); }
+
+    // Returns a pointer to the pushed element
+    T *push(const T &value) {
+        if (m_size >= N) {
+            fprintf(stderr, "Fixed_Array::push: capacity of %d elements exceeded", N);
+            exit(1);
+        }
+        new (get_element_ptr(m_size)) T{ value };
+        ++m_size;
+        return get_element_ptr(m_size-1);
+    }
+
+    void clear() {
+        for (int i = 0; i < m_size; ++i) {
+            get_element_ptr(i)->~T();
+        }
+        m_size = 0;
+    }
+
+    T &operator[](int index) {
+        verify_index(index);
+        return *get_element_ptr(index);
+    }
+
+    const T &operator[](int index) const {
+        verify_index(index);
+        return *get_element_ptr(index);
+    }
+
+    //
+    // Helpers
+    //
+    T *get_element_ptr(int index) const {
+        return (T*)(elements + index * sizeof(T));
+    }
+
+    void verify_index(int index) const {
+        if (index < 0 || index >= m_size) {
+            fprintf(stderr, "Fixed_Array: index out of bounds");
+            exit(1);
+        }
+    }
+};
+
 #endif
\ No newline at end of file
@@ -1 +1 @@
-g++ chess_bot.cpp -o chess_bot -O3
\ No newline at end of file
+g++ chess_bot.cpp -o chess_bot -O3 -pthread
\ No newline at end of file
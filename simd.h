@@ -0,0 +1,232 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#include "basic.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define SIMD_X64
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// Without -mavx2, GCC and Clang only compile AVX2 intrinsics in functions with the avx2 target,
+// MSVC takes them anywhere
+#if defined(__AVX2__) || !defined(__GNUC__)
+#define SIMD_AVX2_FUNCTION inline
+#else
+#define SIMD_AVX2_FUNCTION __attribute__((target("avx2"))) inline
+#endif
+
+//
+// Integer vector kernels for the neural network evaluation. Every kernel has a scalar version
+// (always compiled, used as reference). On x86-64 both an AVX2 and an SSE2 version are compiled and
+// the AVX2 one runs when simd_init finds the CPU has it, x86-64 always has SSE2. A build with -mavx2
+// (or -march=native) uses AVX2 without checking.
+//
+// Lengths must be multiples of SIMD_BLOCK, pointers only need the alignment of their element type.
+//
+#define SIMD_BLOCK 32
+
+inline void add_i16_scalar(i16 *dst, const i16 *src, int n) {
+    for (int i = 0; i < n; ++i) dst[i] = (i16)(dst[i] + src[i]);
+}
+
+inline void sub_i16_scalar(i16 *dst, const i16 *src, int n) {
+    for (int i = 0; i < n; ++i) dst[i] = (i16)(dst[i] - src[i]);
+}
+
+// dst[i] += add[i] - sub[i], one pass for a piece moving from one square to another
+inline void add_sub_i16_scalar(i16 *dst, const i16 *add, const i16 *sub, int n) {
+    for (int i = 0; i < n; ++i) dst[i] = (i16)(dst[i] + add[i] - sub[i]);
+}
+
+// dst[i] = clamp(src[i], 0, 127)
+inline void clipped_relu_i16_scalar(u8 *dst, const i16 *src, int n) {
+    for (int i = 0; i < n; ++i) {
+        int x = src[i];
+        dst[i] = (u8)(x < 0 ? 0 : (x > 127 ? 127 : x));
+    }
+}
+
+// Inputs are at most 127, so u8 * i8 pairs never overflow an i16 in the vector versions
+inline i32 dot_u8_i8_scalar(const u8 *a, const i8 *b, int n) {
+    i32 result = 0;
+    for (int i = 0; i < n; ++i) result += (i32)a[i] * (i32)b[i];
+    return result;
+}
+
+#ifdef SIMD_X64
+
+#ifdef __AVX2__
+const bool simd_avx2 = true; // so the SSE2 branches fold away
+#else
+static bool simd_avx2 = false;
+#endif
+
+inline bool cpu_has_avx2() {
+#ifdef __GNUC__
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#else
+    // AVX2 in the CPU, and the OS saving the YMM registers
+    int info[4];
+    __cpuid(info, 1);
+    if (!(info[2] & (1 << 27)) || (_xgetbv(0) & 6) != 6) return false;
+    __cpuidx(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#endif
+}
+
+// Picks the kernels, before the first network is loaded
+inline void simd_init() {
+#ifndef __AVX2__
+    simd_avx2 = cpu_has_avx2();
+#endif
+}
+
+inline const char *simd_name() {
+    return simd_avx2 ? "avx2" : "sse2";
+}
+
+SIMD_AVX2_FUNCTION void add_i16_avx2(i16 *dst, const i16 *src, int n) {
+    for (int i = 0; i < n; i += 16) {
+        __m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+        __m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_add_epi16(d, s));
+    }
+}
+
+SIMD_AVX2_FUNCTION void sub_i16_avx2(i16 *dst, const i16 *src, int n) {
+    for (int i = 0; i < n; i += 16) {
+        __m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+        __m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_sub_epi16(d, s));
+    }
+}
+
+SIMD_AVX2_FUNCTION void add_sub_i16_avx2(i16 *dst, const i16 *add, const i16 *sub, int n) {
+    for (int i = 0; i < n; i += 16) {
+        __m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+        __m256i a = _mm256_loadu_si256((const __m256i *)(add + i));
+        __m256i s = _mm256_loadu_si256((const __m256i *)(sub + i));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_sub_epi16(_mm256_add_epi16(d, a), s));
+    }
+}
+
+SIMD_AVX2_FUNCTION void clipped_relu_i16_avx2(u8 *dst, const i16 *src, int n) {
+    const __m256i max = _mm256_set1_epi8(127);
+    for (int i = 0; i < n; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(src + i + 16));
+        // packus saturates to 0..255 per 128 bit lane, the permute puts the lanes back in order
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xd8);
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_min_epu8(packed, max));
+    }
+}
+
+SIMD_AVX2_FUNCTION i32 dot_u8_i8_avx2(const u8 *a, const i8 *b, int n) {
+    const __m256i ones = _mm256_set1_epi16(1);
+    __m256i sum = _mm256_setzero_si256();
+    for (int i = 0; i < n; i += 32) {
+        __m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+        __m256i vb = _mm256_loadu_si256((const __m256i *)(b + i));
+        __m256i pairs = _mm256_maddubs_epi16(va, vb);
+        sum = _mm256_add_epi32(sum, _mm256_madd_epi16(pairs, ones));
+    }
+    __m128i s = _mm_add_epi32(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0x4e));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0xb1));
+    return _mm_cvtsi128_si32(s);
+}
+
+inline void add_i16_sse2(i16 *dst, const i16 *src, int n) {
+    for (int i = 0; i < n; i += 8) {
+        __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_add_epi16(d, s));
+    }
+}
+
+inline void sub_i16_sse2(i16 *dst, const i16 *src, int n) {
+    for (int i = 0; i < n; i += 8) {
+        __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_sub_epi16(d, s));
+    }
+}
+
+inline void add_sub_i16_sse2(i16 *dst, const i16 *add, const i16 *sub, int n) {
+    for (int i = 0; i < n; i += 8) {
+        __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+        __m128i a = _mm_loadu_si128((const __m128i *)(add + i));
+        __m128i s = _mm_loadu_si128((const __m128i *)(sub + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_sub_epi16(_mm_add_epi16(d, a), s));
+    }
+}
+
+inline void clipped_relu_i16_sse2(u8 *dst, const i16 *src, int n) {
+    const __m128i max = _mm_set1_epi8(127);
+    for (int i = 0; i < n; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + i + 8));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_min_epu8(_mm_packus_epi16(a, b), max));
+    }
+}
+
+// SSE2 has no u8 * i8 multiply, so both sides are widened to i16 first
+inline i32 dot_u8_i8_sse2(const u8 *a, const i8 *b, int n) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i sum = _mm_setzero_si128();
+    for (int i = 0; i < n; i += 16) {
+        __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+        __m128i sign = _mm_cmpgt_epi8(zero, vb);
+        sum = _mm_add_epi32(sum, _mm_madd_epi16(_mm_unpacklo_epi8(va, zero), _mm_unpacklo_epi8(vb, sign)));
+        sum = _mm_add_epi32(sum, _mm_madd_epi16(_mm_unpackhi_epi8(va, zero), _mm_unpackhi_epi8(vb, sign)));
+    }
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0x4e));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0xb1));
+    return _mm_cvtsi128_si32(sum);
+}
+
+inline void add_i16(i16 *dst, const i16 *src, int n) {
+    if (simd_avx2) add_i16_avx2(dst, src, n);
+    else           add_i16_sse2(dst, src, n);
+}
+
+inline void sub_i16(i16 *dst, const i16 *src, int n) {
+    if (simd_avx2) sub_i16_avx2(dst, src, n);
+    else           sub_i16_sse2(dst, src, n);
+}
+
+inline void add_sub_i16(i16 *dst, const i16 *add, const i16 *sub, int n) {
+    if (simd_avx2) add_sub_i16_avx2(dst, add, sub, n);
+    else           add_sub_i16_sse2(dst, add, sub, n);
+}
+
+inline void clipped_relu_i16(u8 *dst, const i16 *src, int n) {
+    if (simd_avx2) clipped_relu_i16_avx2(dst, src, n);
+    else           clipped_relu_i16_sse2(dst, src, n);
+}
+
+inline i32 dot_u8_i8(const u8 *a, const i8 *b, int n) {
+    if (simd_avx2) return dot_u8_i8_avx2(a, b, n);
+    return dot_u8_i8_sse2(a, b, n);
+}
+
+#else
+
+inline void simd_init() {}
+inline const char *simd_name() { return "scalar"; }
+
+inline void add_i16(i16 *dst, const i16 *src, int n)            { add_i16_scalar(dst, src, n); }
+inline void sub_i16(i16 *dst, const i16 *src, int n)            { sub_i16_scalar(dst, src, n); }
+inline void add_sub_i16(i16 *dst, const i16 *add, const i16 *sub, int n) { add_sub_i16_scalar(dst, add, sub, n); }
+inline void clipped_relu_i16(u8 *dst, const i16 *src, int n)    { clipped_relu_i16_scalar(dst, src, n); }
+inline i32 dot_u8_i8(const u8 *a, const i8 *b, int n)           { return dot_u8_i8_scalar(a, b, n); }
+
+#endif
+
+#endif